@@ -36,6 +36,8 @@
 #include "user_interface.h"
 #include "espconn.h"
 #include "mem.h"
+#include "spi_flash.h"
+#include "sntp.h"
 #include "ESP8266_OTA.h"
 
 //LOCAL LIBRARY VARIABLES/////////////////////////////////////
@@ -55,6 +57,31 @@ static os_timer_t _esp8266_ota_timer;
 //UPGRADE RELATED
 static ESP8266_OTA_OPERATION _esp8266_ota_current_operation;
 static ESP8266_OTA_UPGRADE_STATUS* _esp8266_ota_upgrade;
+static uint8_t _esp8266_ota_new_fw_version_maj;
+static uint8_t _esp8266_ota_new_fw_version_min;
+
+//STAGING RELATED
+static ESP8266_OTA_ACTIVATION_MODE _esp8266_ota_activation_mode;
+static ESP8266_OTA_STAGE_RECORD _esp8266_ota_stage_record;
+static uint16_t _esp8266_ota_stage_sector;
+static os_timer_t _esp8266_ota_stage_timer;
+
+//PUSH RELATED
+static struct espconn _esp8266_ota_push_listener;
+static esp_tcp _esp8266_ota_push_tcp;
+static char* _esp8266_ota_push_password;
+static bool _esp8266_ota_push_listening;
+static ESP8266_OTA_PUSH_STATUS* _esp8266_ota_push;
+static os_timer_t _esp8266_ota_push_timer;
+static os_timer_t _esp8266_ota_push_reject_timer;
+static struct espconn* _esp8266_ota_push_reject_conn;
+static uint8_t _esp8266_ota_push_reject_ip[4];
+static int _esp8266_ota_push_reject_port;
+
+//MD5 ROUTINES IN ESP8266 ROM (NOT DECLARED IN SDK HEADERS)
+extern void MD5Init(ESP8266_OTA_MD5_CTX* ctx);
+extern void MD5Update(ESP8266_OTA_MD5_CTX* ctx, const uint8* input, unsigned int len);
+extern void MD5Final(uint8 digest[16], ESP8266_OTA_MD5_CTX* ctx);
 
 //rboot RELATED
 static void ICACHE_FLASH_ATTR _esp8266_ota_done_cb(bool result, uint8_t rom_slot);
@@ -68,6 +95,43 @@ static void ICACHE_FLASH_ATTR _esp8266_ota_upgrade_recon_cb(void *arg, int8_t er
 static void ICACHE_FLASH_ATTR _esp8266_ota_upgrade_resolved(const char *name, ip_addr_t *ip, void *arg);
 bool ICACHE_FLASH_ATTR _esp8266_ota_rboot_ota_start(ESP8266_OTA_CALLBACK callback);
 bool ICACHE_FLASH_ATTR _esp8266_ota_is_server_fw_version_higher(uint8_t server_major, uint8_t server_minor);
+
+//FLASH LAYOUT RELATED
+static uint32_t ICACHE_FLASH_ATTR _esp8266_ota_flash_size(void);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_flash_read(uint32_t addr, void* dest, uint32_t length);
+static uint32_t ICACHE_FLASH_ATTR _esp8266_ota_rom_max_len(uint8_t rom_slot);
+static uint32_t ICACHE_FLASH_ATTR _esp8266_ota_map_rom_size(void);
+
+//STAGING RELATED
+static uint16_t ICACHE_FLASH_ATTR _esp8266_ota_stage_record_sector(void);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_record_load(void);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_record_save(uint8_t rom_slot);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_record_write(void);
+static void ICACHE_FLASH_ATTR _esp8266_ota_stage_record_clear(void);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_verify_image(uint8_t rom_slot);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_is_version_staged(uint8_t major, uint8_t minor);
+static void ICACHE_FLASH_ATTR _esp8266_ota_stage_schedule_arm(void);
+static void ICACHE_FLASH_ATTR _esp8266_ota_stage_schedule_cb(void* arg);
+
+//PUSH RELATED
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_connect_cb(void* arg);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_recv_cb(void* arg, char* pusrdata, unsigned short length);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_sent_cb(void* arg);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_discon_cb(void* arg);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_recon_cb(void* arg, int8_t errType);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_close_cb(void* arg);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_reject(struct espconn* conn);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_reject_cb(void* arg);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_remote_is(void* arg, uint8_t* ip, int port);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_finish(void);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_reply(const char* message, bool close);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_fail(const char* reason);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_start(void);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_write(uint8_t* data, uint32_t length);
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_hmac_md5(const char* key, const char* message, uint8_t* mac);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_digest_equal(const uint8_t* a, const uint8_t* b);
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_hex_to_bytes(char* hex, uint8_t* bytes, uint8_t count);
+static char* ICACHE_FLASH_ATTR _esp8266_ota_push_next_token(char** cursor);
 //END LOCAL LIBRARY VARIABLES/////////////////////////////////
 
 //CONFIGURATION FUNCTIONS
@@ -92,6 +156,40 @@ void ICACHE_FLASH_ATTR ESP8266_OTA_Initialize(char* server,
     _esp8266_ota_filename_rom0 = name_rom0;
     _esp8266_ota_filename_rom1 = name_rom1;
     os_printf("ESP8266 : OTA : To set ota server parameters, edit rboot-ota.h\n");
+
+    //PICK UP ANY IMAGE STAGED BEFORE THE LAST REBOOT
+    _esp8266_ota_stage_sector = _esp8266_ota_stage_record_sector();
+    if(_esp8266_ota_stage_record_load())
+    {
+        os_printf("ESP8266 : OTA : Staged image found in rom %u, version %u.%u\n",
+                    _esp8266_ota_stage_record.rom_slot,
+                    _esp8266_ota_stage_record.version_maj,
+                    _esp8266_ota_stage_record.version_min);
+
+        //RESUME A SCHEDULE SET BEFORE THE REBOOT
+        if(_esp8266_ota_stage_record.activate_at != 0)
+        {
+            os_printf("ESP8266 : OTA : Resuming scheduled activation at %u\n",
+                        _esp8266_ota_stage_record.activate_at);
+            _esp8266_ota_stage_schedule_arm();
+        }
+        else if(_esp8266_ota_stage_record.activate_minutes > 0)
+        {
+            os_printf("ESP8266 : OTA : Resuming scheduled activation, %u minutes left\n",
+                        _esp8266_ota_stage_record.activate_minutes);
+            _esp8266_ota_stage_schedule_arm();
+        }
+    }
+}
+
+void ICACHE_FLASH_ATTR ESP8266_OTA_SetActivationMode(ESP8266_OTA_ACTIVATION_MODE mode)
+{
+    //SET WHAT HAPPENS WHEN A DOWNLOAD COMPLETES
+    //IMMEDIATE : SWITCH ROM AND REBOOT STRAIGHT AWAY (DEFAULT)
+    //STAGED : VERIFY, PERSIST A STAGE RECORD AND WAIT FOR
+    //         ESP8266_OTA_ActivateStaged() / ESP8266_OTA_ScheduleActivation()
+
+    _esp8266_ota_activation_mode = mode;
 }
 
 bool ICACHE_FLASH_ATTR ESP8266_OTA_Start()
@@ -109,12 +207,195 @@ bool ICACHE_FLASH_ATTR ESP8266_OTA_Start()
     }
 }
 
+bool ICACHE_FLASH_ATTR ESP8266_OTA_IsImageStaged(void)
+{
+    //RETURN TRUE IF A VERIFIED IMAGE IS WAITING IN THE INACTIVE ROM SLOT
+
+    return (_esp8266_ota_stage_record.magic == ESP8266_OTA_STAGE_RECORD_MAGIC);
+}
+
+bool ICACHE_FLASH_ATTR ESP8266_OTA_ActivateStaged(void)
+{
+    //SWITCH TO THE STAGED IMAGE AND REBOOT
+    //THE IMAGE WAS ALREADY VERIFIED AT STAGING TIME SO NOTHING IS RE-READ
+    //FROM FLASH HERE. THE STAGE RECORD IS LEFT AS IS, IT GOES STALE ONCE THE
+    //STAGED ROM IS RUNNING AND IS CLEARED BY ESP8266_OTA_Initialize()
+
+    if(!ESP8266_OTA_IsImageStaged())
+    {
+        os_printf("ESP8266 : OTA : No staged image to activate !\n");
+        return false;
+    }
+
+    //DONT SWITCH ROM UNDER A DOWNLOAD IN PROGRESS
+    if(system_upgrade_flag_check() == ESP8266_OTA_UPGRADE_FLAG_START)
+    {
+        os_printf("ESP8266 : OTA : Update in progress. Not activating !\n");
+        return false;
+    }
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    os_printf("ESP8266 : OTA : Activating staged image. rebooting from rom %u\n", _esp8266_ota_stage_record.rom_slot);
+    if(!rboot_set_current_rom(_esp8266_ota_stage_record.rom_slot))
+    {
+        os_printf("ESP8266 : OTA : Failed to set rom %u !\n", _esp8266_ota_stage_record.rom_slot);
+        return false;
+    }
+    system_restart();
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR ESP8266_OTA_ScheduleActivation(uint32_t delay_minutes)
+{
+    //ACTIVATE THE STAGED IMAGE AFTER delay_minutes
+    //0 ACTIVATES IMMEDIATELY. RESCHEDULING REPLACES ANY EARLIER SCHEDULE
+    //RELATIVE AND BEST EFFORT : POWERED OFF TIME IS NOT COUNTED AND A REBOOT
+    //CAN LOSE UP TO ESP8266_OTA_STAGE_SCHEDULE_SAVE_MINUTES OF PROGRESS.
+    //FOR A FLEET WIDE WINDOW USE ESP8266_OTA_ScheduleActivationAt()
+
+    if(!ESP8266_OTA_IsImageStaged())
+    {
+        return false;
+    }
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    if(delay_minutes == 0)
+    {
+        return ESP8266_OTA_ActivateStaged();
+    }
+
+    _esp8266_ota_stage_record.activate_minutes = delay_minutes;
+    _esp8266_ota_stage_record.activate_at = 0;
+    if(!_esp8266_ota_stage_record_write())
+    {
+        os_printf("ESP8266 : OTA : Failed to save activation schedule !\n");
+        _esp8266_ota_stage_record.activate_minutes = 0;
+        return false;
+    }
+    _esp8266_ota_stage_schedule_arm();
+    os_printf("ESP8266 : OTA : Staged image activation scheduled in %u minutes\n", delay_minutes);
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR ESP8266_OTA_ScheduleActivationAt(uint32_t timestamp)
+{
+    //ACTIVATE THE STAGED IMAGE AT UNIX TIME timestamp (SNTP)
+    //ALL DEVICES GIVEN THE SAME timestamp SWITCH OVER TOGETHER, WHATEVER
+    //REBOOTS OR POWER CYCLES HAPPEN IN BETWEEN. NEEDS SNTP RUNNING IN THE
+    //APPLICATION, NOTHING HAPPENS UNTIL IT HAS SYNCED
+    //RESCHEDULING REPLACES ANY EARLIER SCHEDULE
+
+    if(!ESP8266_OTA_IsImageStaged() || timestamp == 0)
+    {
+        return false;
+    }
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    _esp8266_ota_stage_record.activate_at = timestamp;
+    _esp8266_ota_stage_record.activate_minutes = 0;
+    if(!_esp8266_ota_stage_record_write())
+    {
+        os_printf("ESP8266 : OTA : Failed to save activation schedule !\n");
+        _esp8266_ota_stage_record.activate_at = 0;
+        return false;
+    }
+    _esp8266_ota_stage_schedule_arm();
+    os_printf("ESP8266 : OTA : Staged image activation scheduled at %u\n", timestamp);
+    return true;
+}
+
+void ICACHE_FLASH_ATTR ESP8266_OTA_CancelScheduledActivation(void)
+{
+    //CANCEL A PENDING SCHEDULED ACTIVATION. STAGED IMAGE IS KEPT
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    if(ESP8266_OTA_IsImageStaged() &&
+        (_esp8266_ota_stage_record.activate_minutes > 0 || _esp8266_ota_stage_record.activate_at != 0))
+    {
+        _esp8266_ota_stage_record.activate_minutes = 0;
+        _esp8266_ota_stage_record.activate_at = 0;
+        _esp8266_ota_stage_record_write();
+    }
+}
+
+bool ICACHE_FLASH_ATTR ESP8266_OTA_PushListen(uint16_t port, char* password)
+{
+    //START LISTENING FOR FIRMWARE PUSHED FROM A HOST ON THE LAN
+    //ONE HOST AT A TIME. IMAGE GOES INTO THE INACTIVE ROM SLOT AND IS
+    //COMPLETED THROUGH THE SAME PATH AS A PULL (HONOURS ACTIVATION MODE)
+
+    if(_esp8266_ota_push_listening || password == NULL)
+    {
+        return false;
+    }
+
+    _esp8266_ota_push_password = password;
+
+    os_memset(&_esp8266_ota_push_listener, 0, sizeof(struct espconn));
+    os_memset(&_esp8266_ota_push_tcp, 0, sizeof(esp_tcp));
+    _esp8266_ota_push_tcp.local_port = (port == 0) ? ESP8266_OTA_PUSH_DEFAULT_PORT : port;
+    _esp8266_ota_push_listener.type = ESPCONN_TCP;
+    _esp8266_ota_push_listener.state = ESPCONN_NONE;
+    _esp8266_ota_push_listener.proto.tcp = &_esp8266_ota_push_tcp;
+
+    //FOR SERVER SIDE CONNECTIONS THE SDK RUNS THE DISCONNECT AND ERROR CBS ON
+    //THE LISTENER (WITH THE REMOTE IP/PORT COPIED IN), SO REGISTER THEM HERE
+    espconn_regist_connectcb(&_esp8266_ota_push_listener, _esp8266_ota_push_connect_cb);
+    espconn_regist_disconcb(&_esp8266_ota_push_listener, _esp8266_ota_push_discon_cb);
+    espconn_regist_reconcb(&_esp8266_ota_push_listener, _esp8266_ota_push_recon_cb);
+    if(espconn_accept(&_esp8266_ota_push_listener) != ESPCONN_OK)
+    {
+        os_printf("ESP8266 : OTA : Push listen failed on port %u !\n", _esp8266_ota_push_tcp.local_port);
+        return false;
+    }
+    espconn_tcp_set_max_con_allow(&_esp8266_ota_push_listener, 1);
+    espconn_regist_time(&_esp8266_ota_push_listener, ESP8266_OTA_PUSH_TIMEOUT_S, 0);
+
+    _esp8266_ota_push_listening = true;
+    os_printf("ESP8266 : OTA : Push listening on port %u\n", _esp8266_ota_push_tcp.local_port);
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR ESP8266_OTA_PushStop(void)
+{
+    //STOP ACCEPTING NEW PUSH CONNECTIONS
+    //THE SDK REFUSES TO DELETE A LISTENER WITH A CONNECTION STILL OPEN,
+    //IN WHICH CASE IT STAYS REGISTERED (AND ESP8266_OTA_PushListen KEEPS
+    //REFUSING TO REUSE IT) UNTIL A LATER CALL SUCCEEDS
+    //RETURNS TRUE IF NOT LISTENING ANY MORE
+
+    if(!_esp8266_ota_push_listening)
+    {
+        return true;
+    }
+    if(espconn_delete(&_esp8266_ota_push_listener) != ESPCONN_OK)
+    {
+        os_printf("ESP8266 : OTA : Push listener busy, not stopped !\n");
+        return false;
+    }
+    _esp8266_ota_push_listening = false;
+    return true;
+}
+
 static void ICACHE_FLASH_ATTR _esp8266_ota_done_cb(bool result, uint8_t rom_slot)
 {
     //RBOOT OTA CB FUNCTION
     char* message = (char*)os_zalloc(80);
 
-    if(result)
+    if(result && _esp8266_ota_activation_mode == ESP8266_OTA_ACTIVATION_STAGED)
+    {
+        //VERIFY ONCE NOW SO ACTIVATION CAN SKIP IT
+        if(_esp8266_ota_stage_verify_image(rom_slot) && _esp8266_ota_stage_record_save(rom_slot))
+        {
+            os_sprintf(message, "ESP8266 : OTA : Firmware staged in rom %u. Waiting for activation\n", rom_slot);
+        }
+        else
+        {
+            os_sprintf(message, "ESP8266 : OTA : Firmware staging failed !\n");
+        }
+        os_printf(message);
+    }
+    else if(result)
     {
         os_sprintf(message, "ESP8266 : OTA : Firmware updated. rebooting from rom %u\n", rom_slot);
         os_printf(message);
@@ -223,12 +504,25 @@ static void ICACHE_FLASH_ATTR _esp8266_ota_upgrade_recvcb(void *arg, char *pusrd
                 os_printf("ESP8266 : OTA : Extracted version info : major = %u, minor = %u\n", version_maj, version_min);
                 os_printf("ESP8266 : OTA : Running version info : major = %u, minor = %u\n", ESP8266_OTA_USER_FW_VERSION_MAJ, ESP8266_OTA_USER_FW_VERSION_MIN);
 
-                if(_esp8266_ota_is_server_fw_version_higher(version_maj, version_min)==true)
+                _esp8266_ota_new_fw_version_maj = version_maj;
+                _esp8266_ota_new_fw_version_min = version_min;
+
+                if(_esp8266_ota_stage_is_version_staged(version_maj, version_min))
+                {
+                    //SAME OR NEWER IMAGE ALREADY STAGED
+                    //NO NEED TO DOWNLOAD AGAIN
+                    os_printf("ESP8266 : OTA : Server FW is already staged. Ending !\n");
+                    _esp8266_ota_rboot_ota_deinit();
+                }
+                else if(_esp8266_ota_is_server_fw_version_higher(version_maj, version_min)==true)
                 {
                     //SERVER HAS NEWER FIRMWARE
                     //NEED TO DO OTA
                     os_printf("ESP8266 : OTA : Server FW is newer than current. Proceeding !\n");
                     _esp8266_ota_current_operation = ESP8266_OTA_SERVER_OPERATION_GET_FILE_FW;
+                    //INACTIVE SLOT IS ABOUT TO BE OVERWRITTEN
+                    //ANY IMAGE STAGED THERE IS NO LONGER VALID
+                    _esp8266_ota_stage_record_clear();
                     //_esp8266_ota_upgrade_connect_cb(NULL);
                     char* request = (char*)os_malloc(512);
                     os_sprintf((char*)request,
@@ -579,3 +873,938 @@ bool ICACHE_FLASH_ATTR _esp8266_ota_is_server_fw_version_higher(uint8_t server_m
     else
         return false;
 }
+
+static uint32_t ICACHE_FLASH_ATTR _esp8266_ota_flash_size(void)
+{
+    //RETURN FLASH CHIP SIZE IN BYTES FROM THE SDK SIZE MAP
+    //0 IF THE MAP IS NOT KNOWN
+
+    switch(system_get_flash_size_map())
+    {
+        case FLASH_SIZE_2M:
+            return 0x40000;
+        case FLASH_SIZE_4M_MAP_256_256:
+            return 0x80000;
+        case FLASH_SIZE_8M_MAP_512_512:
+            return 0x100000;
+        case FLASH_SIZE_16M_MAP_512_512:
+        case FLASH_SIZE_16M_MAP_1024_1024:
+            return 0x200000;
+        case FLASH_SIZE_32M_MAP_512_512:
+        case FLASH_SIZE_32M_MAP_1024_1024:
+            return 0x400000;
+        default:
+            return 0;
+    }
+}
+
+static uint32_t ICACHE_FLASH_ATTR _esp8266_ota_rom_max_len(uint8_t rom_slot)
+{
+    //SPACE AVAILABLE FOR AN IMAGE IN rom_slot : UP TO THE NEXT ROM, OR FOR
+    //THE LAST ROM UP TO THE STAGE RECORD / RF CAL / SYSTEM PARAM SECTORS,
+    //NEVER MORE THAN THE ROM SIZE OF THE SIZE MAP (WHAT A ROM CAN MAP, ANY
+    //FLASH BEYOND IT MAY HOLD USER DATA SUCH AS SPIFFS)
+    //0 IF THE FLASH SIZE IS NOT KNOWN
+
+    rboot_config bootconf = rboot_get_config();
+    uint32_t flash_size = _esp8266_ota_flash_size();
+    uint32_t map_rom_size = _esp8266_ota_map_rom_size();
+    uint32_t start, end, stage_addr;
+    uint8_t i;
+
+    if(flash_size == 0 || map_rom_size == 0 || rom_slot >= bootconf.count)
+    {
+        return 0;
+    }
+
+    start = bootconf.roms[rom_slot];
+    end = flash_size - (ESP8266_OTA_SYSTEM_SECTORS * ESP8266_OTA_FLASH_SECTOR_SIZE);
+    stage_addr = (uint32_t)_esp8266_ota_stage_sector * ESP8266_OTA_FLASH_SECTOR_SIZE;
+    if(stage_addr > start && stage_addr < end)
+    {
+        end = stage_addr;
+    }
+    for(i = 0; i < bootconf.count; i++)
+    {
+        if(bootconf.roms[i] > start && bootconf.roms[i] < end)
+        {
+            end = bootconf.roms[i];
+        }
+    }
+    if(end > start && (end - start) > map_rom_size)
+    {
+        end = start + map_rom_size;
+    }
+    return (end > start) ? (end - start) : 0;
+}
+
+static uint32_t ICACHE_FLASH_ATTR _esp8266_ota_map_rom_size(void)
+{
+    //ROM SIZE OF THE SDK SIZE MAP (256 + 256 / 512 + 512 / 1024 + 1024)
+    //0 IF THE MAP IS NOT KNOWN
+
+    switch(system_get_flash_size_map())
+    {
+        case FLASH_SIZE_2M:
+        case FLASH_SIZE_4M_MAP_256_256:
+            return 0x40000;
+        case FLASH_SIZE_8M_MAP_512_512:
+        case FLASH_SIZE_16M_MAP_512_512:
+        case FLASH_SIZE_32M_MAP_512_512:
+            return 0x80000;
+        case FLASH_SIZE_16M_MAP_1024_1024:
+        case FLASH_SIZE_32M_MAP_1024_1024:
+            return 0x100000;
+        default:
+            return 0;
+    }
+}
+
+static uint16_t ICACHE_FLASH_ATTR _esp8266_ota_stage_record_sector(void)
+{
+    //FIRST OF THE 3 SECTORS HOLDING THE STAGE RECORD
+    //JUST BELOW THE RF CAL + SYSTEM PARAM SECTORS AT THE END OF FLASH
+    //0 (BOOTLOADER, NEVER VALID) IF THE FLASH SIZE IS NOT KNOWN
+
+#ifdef ESP8266_OTA_STAGE_RECORD_SECTOR
+    return ESP8266_OTA_STAGE_RECORD_SECTOR;
+#else
+    uint32_t flash_size = _esp8266_ota_flash_size();
+
+    if(flash_size == 0)
+    {
+        os_printf("ESP8266 : OTA : Unknown flash size map. Staging disabled !\n");
+        return 0;
+    }
+    return (flash_size / ESP8266_OTA_FLASH_SECTOR_SIZE) -
+            ESP8266_OTA_SYSTEM_SECTORS -
+            ESP8266_OTA_STAGE_RECORD_SECTORS;
+#endif
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_record_load(void)
+{
+    //LOAD THE STAGE RECORD FROM FLASH INTO RAM
+    //A RECORD IS ONLY VALID WHILE ITS ROM IS NOT THE RUNNING ONE AND
+    //STILL MATCHES THE rBoot CONFIG. STALE RECORDS ARE CLEARED
+    //RETURNS TRUE IF A VALID STAGED IMAGE EXISTS
+
+    rboot_config bootconf;
+
+    if(_esp8266_ota_stage_sector == 0 ||
+        !system_param_load(_esp8266_ota_stage_sector, 0,
+                            &_esp8266_ota_stage_record,
+                            sizeof(ESP8266_OTA_STAGE_RECORD)) ||
+        _esp8266_ota_stage_record.magic != ESP8266_OTA_STAGE_RECORD_MAGIC)
+    {
+        os_memset(&_esp8266_ota_stage_record, 0, sizeof(ESP8266_OTA_STAGE_RECORD));
+        return false;
+    }
+
+    bootconf = rboot_get_config();
+    if(_esp8266_ota_stage_record.rom_slot == bootconf.current_rom ||
+        _esp8266_ota_stage_record.rom_slot >= bootconf.count ||
+        _esp8266_ota_stage_record.rom_addr != bootconf.roms[_esp8266_ota_stage_record.rom_slot])
+    {
+        //STAGED IMAGE IS NOW RUNNING (OR RECORD IS STALE)
+        os_printf("ESP8266 : OTA : Clearing stale stage record\n");
+        _esp8266_ota_stage_record_clear();
+        return false;
+    }
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_record_save(uint8_t rom_slot)
+{
+    //PERSIST A STAGE RECORD FOR THE IMAGE JUST WRITTEN TO rom_slot
+
+    rboot_config bootconf = rboot_get_config();
+
+    if(_esp8266_ota_stage_sector == 0)
+    {
+        return false;
+    }
+
+    _esp8266_ota_stage_record.magic = ESP8266_OTA_STAGE_RECORD_MAGIC;
+    _esp8266_ota_stage_record.rom_addr = bootconf.roms[rom_slot];
+    _esp8266_ota_stage_record.rom_slot = rom_slot;
+    _esp8266_ota_stage_record.version_maj = _esp8266_ota_new_fw_version_maj;
+    _esp8266_ota_stage_record.version_min = _esp8266_ota_new_fw_version_min;
+    _esp8266_ota_stage_record.reserved = 0;
+    _esp8266_ota_stage_record.activate_minutes = 0;
+    _esp8266_ota_stage_record.activate_at = 0;
+
+    if(!_esp8266_ota_stage_record_write())
+    {
+        os_memset(&_esp8266_ota_stage_record, 0, sizeof(ESP8266_OTA_STAGE_RECORD));
+        return false;
+    }
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_record_write(void)
+{
+    //WRITE THE RAM COPY OF THE STAGE RECORD TO FLASH
+
+    if(_esp8266_ota_stage_sector == 0)
+    {
+        return false;
+    }
+    return system_param_save_with_protect(_esp8266_ota_stage_sector,
+                                            &_esp8266_ota_stage_record,
+                                            sizeof(ESP8266_OTA_STAGE_RECORD));
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_stage_record_clear(void)
+{
+    //INVALIDATE THE STAGE RECORD IN RAM AND FLASH
+    //RAM COPY MIRRORS FLASH (LOADED IN ESP8266_OTA_Initialize) SO
+    //THE FLASH WRITE IS SKIPPED IF THERE IS NOTHING TO CLEAR
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    if(!ESP8266_OTA_IsImageStaged())
+    {
+        return;
+    }
+    os_memset(&_esp8266_ota_stage_record, 0, sizeof(ESP8266_OTA_STAGE_RECORD));
+    _esp8266_ota_stage_record_write();
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_verify_image(uint8_t rom_slot)
+{
+    //WALK THE SECTIONS OF THE ROM WRITTEN TO rom_slot AND CHECK THE IMAGE
+    //CHECKSUM, THE SAME WAY rBoot check_image() DOES AT BOOT
+    //DONE ONCE AT STAGING TIME SO ACTIVATION DOES NOT HAVE TO
+    //AS IN rBoot, THE IROM0 SECTION OF A NEW TYPE ROM IS ONLY
+    //CHECKSUMMED IF BOOT_IROM_CHKSUM IS DEFINED
+
+    rboot_config bootconf = rboot_get_config();
+    ESP8266_OTA_ROM_HEADER_NEW header;
+    ESP8266_OTA_SECTION_HEADER section;
+    uint8_t buffer[ESP8266_OTA_VERIFY_BUFFER_SIZE];
+    uint8_t chksum = ESP8266_OTA_ROM_CHKSUM_INIT;
+    uint8_t stored_chksum;
+    uint8_t sectcount, sectcurrent;
+    uint32_t readpos, remaining, readlen, loop;
+
+    readpos = bootconf.roms[rom_slot];
+    if(!_esp8266_ota_flash_read(readpos, &header, sizeof(ESP8266_OTA_ROM_HEADER_NEW)))
+    {
+        return false;
+    }
+
+    if(header.magic == ESP8266_OTA_ROM_MAGIC)
+    {
+        //OLD TYPE, NO EXTRA HEADER OR IROM0 SECTION TO SKIP OVER
+        readpos += sizeof(ESP8266_OTA_ROM_HEADER);
+        sectcount = header.count;
+    }
+    else if(header.magic == ESP8266_OTA_ROM_MAGIC_NEW && header.count == ESP8266_OTA_ROM_MAGIC_NEW2)
+    {
+#ifdef BOOT_IROM_CHKSUM
+        //IROM0 SECTION FIRST, REAL SECTION COUNT IS READ AFTER IT
+        sectcount = 0xFF;
+        readpos += sizeof(ESP8266_OTA_ROM_HEADER);
+#else
+        //SKIP THE EXTRA HEADER AND IROM0 SECTION
+        readpos += header.len + sizeof(ESP8266_OTA_ROM_HEADER_NEW);
+        if(!_esp8266_ota_flash_read(readpos, &header, sizeof(ESP8266_OTA_ROM_HEADER)))
+        {
+            return false;
+        }
+        sectcount = header.count;
+        readpos += sizeof(ESP8266_OTA_ROM_HEADER);
+#endif
+    }
+    else
+    {
+        os_printf("ESP8266 : OTA : Bad rom header 0x%02x in rom %u !\n", header.magic, rom_slot);
+        return false;
+    }
+
+    //CHECKSUM EACH SECTION
+    for(sectcurrent = 0; sectcurrent < sectcount; sectcurrent++)
+    {
+        if(!_esp8266_ota_flash_read(readpos, &section, sizeof(ESP8266_OTA_SECTION_HEADER)))
+        {
+            return false;
+        }
+        readpos += sizeof(ESP8266_OTA_SECTION_HEADER);
+
+        remaining = section.length;
+        while(remaining > 0)
+        {
+            readlen = (remaining < ESP8266_OTA_VERIFY_BUFFER_SIZE) ? remaining : ESP8266_OTA_VERIFY_BUFFER_SIZE;
+            if(!_esp8266_ota_flash_read(readpos, buffer, readlen))
+            {
+                return false;
+            }
+            readpos += readlen;
+            remaining -= readlen;
+            for(loop = 0; loop < readlen; loop++)
+            {
+                chksum ^= buffer[loop];
+            }
+        }
+
+        if(sectcount == 0xFF)
+        {
+            //JUST DID THE IROM0 SECTION, READ THE NORMAL HEADER THAT FOLLOWS
+            if(!_esp8266_ota_flash_read(readpos, &header, sizeof(ESP8266_OTA_ROM_HEADER)))
+            {
+                return false;
+            }
+            sectcount = header.count;
+            readpos += sizeof(ESP8266_OTA_ROM_HEADER);
+            //LOOP INCREMENT STARTS THE REAL SECTIONS AT 0
+            sectcurrent = 0xFF;
+        }
+    }
+
+    //CHECKSUM IS IN THE LAST BYTE OF THE NEXT 16 BYTE BOUNDARY
+    readpos = readpos | 0x0F;
+    if(!_esp8266_ota_flash_read(readpos, &stored_chksum, 1))
+    {
+        return false;
+    }
+    if(stored_chksum != chksum)
+    {
+        os_printf("ESP8266 : OTA : Bad checksum in rom %u (0x%02x != 0x%02x) !\n", rom_slot, stored_chksum, chksum);
+        return false;
+    }
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_flash_read(uint32_t addr, void* dest, uint32_t length)
+{
+    //READ length (<= ESP8266_OTA_VERIFY_BUFFER_SIZE) BYTES FROM ANY FLASH ADDRESS
+    //spi_flash_read NEEDS A 4 BYTE ALIGNED ADDRESS AND LENGTH
+    //FAILS IF THE READ WOULD GO PAST THE END OF FLASH
+
+    uint32 words[(ESP8266_OTA_VERIFY_BUFFER_SIZE / 4) + 2];
+    uint32_t offset = addr & 0x03;
+    uint32_t aligned_len = (offset + length + 3) & ~0x03;
+    uint32_t flash_size = _esp8266_ota_flash_size();
+
+    if(length > ESP8266_OTA_VERIFY_BUFFER_SIZE ||
+        (flash_size != 0 && (addr + length) > flash_size))
+    {
+        return false;
+    }
+    if(spi_flash_read(addr - offset, words, aligned_len) != SPI_FLASH_RESULT_OK)
+    {
+        return false;
+    }
+    os_memcpy(dest, (uint8_t*)words + offset, length);
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_stage_is_version_staged(uint8_t major, uint8_t minor)
+{
+    //TRUE IF THE STAGED IMAGE IS THE SAME OR NEWER THAN major.minor
+
+    if(!ESP8266_OTA_IsImageStaged())
+        return false;
+    if(_esp8266_ota_stage_record.version_maj > major)
+        return true;
+    else if(_esp8266_ota_stage_record.version_maj == major)
+        return (_esp8266_ota_stage_record.version_min >= minor);
+    else
+        return false;
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_stage_schedule_arm(void)
+{
+    //(RE)START THE SCHEDULE TICK FOR THE SCHEDULE IN THE STAGE RECORD
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    os_timer_setfn(&_esp8266_ota_stage_timer, (os_timer_func_t *)_esp8266_ota_stage_schedule_cb, NULL);
+    os_timer_arm(&_esp8266_ota_stage_timer,
+                    (_esp8266_ota_stage_record.activate_at != 0) ?
+                        ESP8266_OTA_STAGE_SCHEDULE_AT_TICK_MS : ESP8266_OTA_STAGE_SCHEDULE_TICK_MS,
+                    1);
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_stage_schedule_cb(void* arg)
+{
+    //SCHEDULED ACTIVATION TICK
+    //ABSOLUTE : DUE ONCE SNTP TIME REACHES activate_at (0 = NOT SYNCED YET)
+    //RELATIVE : ONE MINUTE PER TICK, COUNTDOWN IS WRITTEN BACK EVERY
+    //           ESP8266_OTA_STAGE_SCHEDULE_SAVE_MINUTES TO LIMIT FLASH WEAR
+
+    uint32 now;
+    bool due;
+
+    if(_esp8266_ota_stage_record.activate_at != 0)
+    {
+        now = sntp_get_current_timestamp();
+        due = (now != 0 && now >= _esp8266_ota_stage_record.activate_at);
+    }
+    else
+    {
+        if(_esp8266_ota_stage_record.activate_minutes > 0)
+        {
+            _esp8266_ota_stage_record.activate_minutes--;
+            if(_esp8266_ota_stage_record.activate_minutes > 0 &&
+                (_esp8266_ota_stage_record.activate_minutes % ESP8266_OTA_STAGE_SCHEDULE_SAVE_MINUTES) == 0)
+            {
+                _esp8266_ota_stage_record_write();
+            }
+        }
+        due = (_esp8266_ota_stage_record.activate_minutes == 0);
+    }
+
+    if(!due)
+    {
+        return;
+    }
+
+    os_timer_disarm(&_esp8266_ota_stage_timer);
+    if(!ESP8266_OTA_ActivateStaged())
+    {
+        //UPDATE IN PROGRESS, TRY AGAIN NEXT TICK
+        //(AN ABSOLUTE SCHEDULE STAYS DUE AS IS)
+        if(ESP8266_OTA_IsImageStaged())
+        {
+            if(_esp8266_ota_stage_record.activate_at == 0)
+            {
+                _esp8266_ota_stage_record.activate_minutes = 1;
+            }
+            _esp8266_ota_stage_schedule_arm();
+        }
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_connect_cb(void* arg)
+{
+    //HOST CONNECTED TO PUSH LISTENER. SEND THE AUTH NONCE
+    struct espconn* conn = (struct espconn*)arg;
+    rboot_config bootconf;
+    char* message;
+
+    //ONE UPDATE AT A TIME (PUSH OR PULL)
+    if(_esp8266_ota_push || system_upgrade_flag_check() == ESP8266_OTA_UPGRADE_FLAG_START)
+    {
+        os_printf("ESP8266 : OTA : Push rejected, update in progress !\n");
+        _esp8266_ota_push_reject(conn);
+        return;
+    }
+
+    _esp8266_ota_push = (ESP8266_OTA_PUSH_STATUS*)os_zalloc(sizeof(ESP8266_OTA_PUSH_STATUS));
+    if(!_esp8266_ota_push)
+    {
+        os_printf("No ram!\r\n");
+        _esp8266_ota_push_reject(conn);
+        return;
+    }
+    _esp8266_ota_push->conn = conn;
+    os_memcpy(_esp8266_ota_push->remote_ip, conn->proto.tcp->remote_ip, 4);
+    _esp8266_ota_push->remote_port = conn->proto.tcp->remote_port;
+    _esp8266_ota_push->state = ESP8266_OTA_PUSH_STATE_HEADER;
+
+    //GET DETAILS OF ROM SLOT TO UPDATE
+    bootconf = rboot_get_config();
+    _esp8266_ota_push->rom_slot = (bootconf.current_rom == 0) ? 1 : 0;
+
+    espconn_regist_recvcb(conn, _esp8266_ota_push_recv_cb);
+    espconn_regist_sentcb(conn, _esp8266_ota_push_sent_cb);
+
+    os_sprintf(_esp8266_ota_push->nonce, "%08x", (uint32)os_random());
+    message = (char*)os_zalloc(ESP8266_OTA_PUSH_REPLY_MAX_LEN);
+    if(!message)
+    {
+        os_printf("No ram!\r\n");
+        _esp8266_ota_push_fail("NORAM");
+        return;
+    }
+    os_sprintf(message, "OTA NONCE %s %u\n", _esp8266_ota_push->nonce, _esp8266_ota_push->rom_slot);
+    os_printf("ESP8266 : OTA : Push connection accepted\n");
+    _esp8266_ota_push_reply(message, false);
+    os_free(message);
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_recv_cb(void* arg, char* pusrdata, unsigned short length)
+{
+    //PUSH CONNECTION RECEIVED DATA
+    //HEADER LINE FIRST (MAY SPAN CHUNKS), THEN RAW IMAGE BYTES
+
+    if(!_esp8266_ota_push ||
+        !_esp8266_ota_push_remote_is(arg, _esp8266_ota_push->remote_ip, _esp8266_ota_push->remote_port))
+    {
+        return;
+    }
+
+    if(_esp8266_ota_push->state == ESP8266_OTA_PUSH_STATE_HEADER)
+    {
+        //ACCUMULATE UNTIL END OF HEADER LINE
+        while(length > 0 && *pusrdata != '\n')
+        {
+            if(_esp8266_ota_push->header_len >= (ESP8266_OTA_PUSH_HEADER_MAX_LEN - 1))
+            {
+                _esp8266_ota_push_fail("HEADER");
+                return;
+            }
+            _esp8266_ota_push->header[_esp8266_ota_push->header_len++] = *pusrdata++;
+            length--;
+        }
+        if(length == 0)
+        {
+            //NEED MORE
+            return;
+        }
+        //SKIP THE \n
+        pusrdata++;
+        length--;
+
+        if(!_esp8266_ota_push_start())
+        {
+            return;
+        }
+    }
+
+    if(_esp8266_ota_push->state == ESP8266_OTA_PUSH_STATE_DATA && length > 0)
+    {
+        _esp8266_ota_push_write((uint8_t*)pusrdata, length);
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_sent_cb(void* arg)
+{
+    //PREVIOUS REPLY SENT. SEND ANY QUEUED REPLY OR CLOSE IF DONE
+
+    if(!_esp8266_ota_push ||
+        !_esp8266_ota_push_remote_is(arg, _esp8266_ota_push->remote_ip, _esp8266_ota_push->remote_port))
+    {
+        return;
+    }
+
+    _esp8266_ota_push->sending = false;
+    if(_esp8266_ota_push->pending[0] != '\0')
+    {
+        _esp8266_ota_push->sending = true;
+        if(espconn_sent(_esp8266_ota_push->conn,
+                        (uint8*)_esp8266_ota_push->pending,
+                        os_strlen(_esp8266_ota_push->pending)) != ESPCONN_OK)
+        {
+            _esp8266_ota_push->sending = false;
+        }
+        _esp8266_ota_push->pending[0] = '\0';
+    }
+
+    if(!_esp8266_ota_push->sending && _esp8266_ota_push->state == ESP8266_OTA_PUSH_STATE_CLOSING)
+    {
+        os_timer_disarm(&_esp8266_ota_push_timer);
+        os_timer_setfn(&_esp8266_ota_push_timer, (os_timer_func_t *)_esp8266_ota_push_close_cb, 0);
+        os_timer_arm(&_esp8266_ota_push_timer, ESP8266_OTA_PUSH_CLOSE_DELAY_MS, 0);
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_discon_cb(void* arg)
+{
+    //A CONNECTION ON THE PUSH LISTENER IS GONE (EITHER END, OR INACTIVITY
+    //TIMEOUT). arg IS THE LISTENER, NOT THE ACCEPTED espconn (ALREADY FREED),
+    //SO TELL THE PUSH FROM A REJECTED CONNECTION BY REMOTE IP/PORT
+
+    if(_esp8266_ota_push_reject_conn &&
+        _esp8266_ota_push_remote_is(arg, _esp8266_ota_push_reject_ip, _esp8266_ota_push_reject_port))
+    {
+        //REJECTED CONNECTION GONE, FORGET IT
+        os_timer_disarm(&_esp8266_ota_push_reject_timer);
+        _esp8266_ota_push_reject_conn = NULL;
+        return;
+    }
+
+    if(_esp8266_ota_push &&
+        _esp8266_ota_push_remote_is(arg, _esp8266_ota_push->remote_ip, _esp8266_ota_push->remote_port))
+    {
+        _esp8266_ota_push_finish();
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_recon_cb(void* arg, int8_t errType)
+{
+    //CONNECTION ERROR ON THE PUSH LISTENER. NO DISCONNECT CB WILL FOLLOW
+    //SO CLEAN UP THE SAME WAY
+
+    os_printf("Connection error: ");
+    os_printf(_esp8266_ota_esp_errstr(errType));
+    os_printf("\r\n");
+    _esp8266_ota_push_discon_cb(arg);
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_finish(void)
+{
+    //PUSH CONNECTION GONE
+    //FINISH THE UPDATE THROUGH THE SAME COMPLETION PATH AS A PULL
+
+    bool result;
+    uint8_t rom_slot;
+
+    //THE CONNECTION IS FREED, NO DEFERRED CLOSE MAY TOUCH IT
+    os_timer_disarm(&_esp8266_ota_push_timer);
+    result = _esp8266_ota_push->result;
+    rom_slot = _esp8266_ota_push->rom_slot;
+    if(_esp8266_ota_push->upgrading && !result)
+    {
+        system_upgrade_flag_set(ESP8266_OTA_UPGRADE_FLAG_IDLE);
+    }
+    os_free(_esp8266_ota_push);
+    _esp8266_ota_push = NULL;
+
+    if(result)
+    {
+        _esp8266_ota_done_cb(true, rom_slot);
+    }
+    else
+    {
+        os_printf("ESP8266 : OTA : Push connection closed\n");
+    }
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_remote_is(void* arg, uint8_t* ip, int port)
+{
+    //TRUE IF THE espconn arg IS CONNECTED TO ip:port
+
+    struct espconn* conn = (struct espconn*)arg;
+
+    return (conn && conn->proto.tcp &&
+            conn->proto.tcp->remote_port == port &&
+            os_memcmp(conn->proto.tcp->remote_ip, ip, 4) == 0);
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_close_cb(void* arg)
+{
+    //DEFERRED DISCONNECT OF THE PUSH CONNECTION
+
+    if(_esp8266_ota_push)
+    {
+        espconn_disconnect(_esp8266_ota_push->conn);
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_reject(struct espconn* conn)
+{
+    //CLOSE A CONNECTION WE ARE NOT SERVING (NO PUSH STATUS FOR IT)
+    //DEFERRED THROUGH ITS OWN TIMER, _esp8266_ota_push_timer BELONGS TO THE
+    //ACTIVE PUSH. ONLY ONE REJECT IS TRACKED, ANY OTHER IS LEFT TO THE
+    //LISTENER INACTIVITY TIMEOUT
+
+    if(_esp8266_ota_push_reject_conn)
+    {
+        return;
+    }
+
+    _esp8266_ota_push_reject_conn = conn;
+    os_memcpy(_esp8266_ota_push_reject_ip, conn->proto.tcp->remote_ip, 4);
+    _esp8266_ota_push_reject_port = conn->proto.tcp->remote_port;
+    os_timer_disarm(&_esp8266_ota_push_reject_timer);
+    os_timer_setfn(&_esp8266_ota_push_reject_timer, (os_timer_func_t *)_esp8266_ota_push_reject_cb, 0);
+    os_timer_arm(&_esp8266_ota_push_reject_timer, ESP8266_OTA_PUSH_CLOSE_DELAY_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_reject_cb(void* arg)
+{
+    //DEFERRED DISCONNECT OF A REJECTED CONNECTION
+
+    if(_esp8266_ota_push_reject_conn)
+    {
+        espconn_disconnect(_esp8266_ota_push_reject_conn);
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_reply(const char* message, bool close)
+{
+    //SEND A REPLY LINE TO THE HOST
+    //ONLY ONE espconn_sent CAN BE OUTSTANDING, SO A REPLY MADE WHILE BUSY IS
+    //QUEUED (PROGRESS REPLIES ARE DROPPED INSTEAD, SEE _esp8266_ota_push_write)
+    //close : DISCONNECT ONCE THIS REPLY HAS GONE OUT
+
+    if(close)
+    {
+        _esp8266_ota_push->state = ESP8266_OTA_PUSH_STATE_CLOSING;
+    }
+
+    if(_esp8266_ota_push->sending)
+    {
+        os_strncpy(_esp8266_ota_push->pending, message, ESP8266_OTA_PUSH_REPLY_MAX_LEN - 1);
+        return;
+    }
+
+    _esp8266_ota_push->sending = true;
+    if(espconn_sent(_esp8266_ota_push->conn, (uint8*)message, os_strlen(message)) != ESPCONN_OK)
+    {
+        _esp8266_ota_push->sending = false;
+        if(close)
+        {
+            os_timer_disarm(&_esp8266_ota_push_timer);
+            os_timer_setfn(&_esp8266_ota_push_timer, (os_timer_func_t *)_esp8266_ota_push_close_cb, 0);
+            os_timer_arm(&_esp8266_ota_push_timer, ESP8266_OTA_PUSH_CLOSE_DELAY_MS, 0);
+        }
+    }
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_fail(const char* reason)
+{
+    //ABORT THE PUSH, TELL THE HOST WHY AND CLOSE
+
+    char message[ESP8266_OTA_PUSH_REPLY_MAX_LEN];
+
+    os_printf("ESP8266 : OTA : Push failed : %s !\n", reason);
+    _esp8266_ota_push->result = false;
+    os_sprintf(message, "OTA ERR %s\n", reason);
+    _esp8266_ota_push_reply(message, true);
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_start(void)
+{
+    //PARSE AND CHECK THE PUSH HEADER, THEN PREPARE THE INACTIVE ROM SLOT
+    //OTA <auth> <length> <major> <minor> <md5>
+
+    char* cursor = _esp8266_ota_push->header;
+    char* token[6];
+    char signed_fields[ESP8266_OTA_PUSH_HEADER_MAX_LEN + 16];
+    char message[ESP8266_OTA_PUSH_REPLY_MAX_LEN];
+    uint8_t auth[16];
+    uint8_t expected[16];
+    uint8_t i;
+    uint32_t version_maj, version_min;
+    rboot_config bootconf;
+
+    _esp8266_ota_push->header[_esp8266_ota_push->header_len] = '\0';
+    for(i = 0; i < 6; i++)
+    {
+        token[i] = _esp8266_ota_push_next_token(&cursor);
+        if(token[i] == NULL)
+        {
+            _esp8266_ota_push_fail("HEADER");
+            return false;
+        }
+    }
+    if(os_strcmp(token[0], "OTA") != 0)
+    {
+        _esp8266_ota_push_fail("HEADER");
+        return false;
+    }
+
+    //AUTHENTICATE : HMAC-MD5(password, "<nonce> <length> <major> <minor> <md5>")
+    //COVERS EVERY HEADER FIELD SO NONE CAN BE SWAPPED UNDER A VALID TOKEN
+    os_sprintf(signed_fields, "%s %s %s %s %s",
+                _esp8266_ota_push->nonce, token[2], token[3], token[4], token[5]);
+    _esp8266_ota_push_hmac_md5(_esp8266_ota_push_password, signed_fields, expected);
+    if(!_esp8266_ota_push_hex_to_bytes(token[1], auth, 16) ||
+        !_esp8266_ota_push_digest_equal(auth, expected))
+    {
+        _esp8266_ota_push_fail("AUTH");
+        return false;
+    }
+
+    _esp8266_ota_push->content_len = atoi(token[2]);
+    version_maj = atoi(token[3]);
+    version_min = atoi(token[4]);
+    if(_esp8266_ota_push->content_len == 0 ||
+        _esp8266_ota_push->content_len > _esp8266_ota_rom_max_len(_esp8266_ota_push->rom_slot))
+    {
+        _esp8266_ota_push_fail("LENGTH");
+        return false;
+    }
+    if(!_esp8266_ota_push_hex_to_bytes(token[5], _esp8266_ota_push->digest, 16))
+    {
+        _esp8266_ota_push_fail("HEADER");
+        return false;
+    }
+
+    os_printf("ESP8266 : OTA : Push version info : major = %u, minor = %u, length = %u\n",
+                version_maj, version_min, _esp8266_ota_push->content_len);
+    if(_esp8266_ota_stage_is_version_staged(version_maj, version_min))
+    {
+        _esp8266_ota_push_fail("STAGED");
+        return false;
+    }
+    if(!_esp8266_ota_is_server_fw_version_higher(version_maj, version_min))
+    {
+        _esp8266_ota_push_fail("VERSION");
+        return false;
+    }
+
+    //A PULL MAY HAVE STARTED SINCE THE HOST CONNECTED
+    if(system_upgrade_flag_check() == ESP8266_OTA_UPGRADE_FLAG_START)
+    {
+        _esp8266_ota_push_fail("BUSY");
+        return false;
+    }
+    system_upgrade_flag_set(ESP8266_OTA_UPGRADE_FLAG_START);
+    _esp8266_ota_push->upgrading = true;
+
+    //INACTIVE SLOT IS ABOUT TO BE OVERWRITTEN
+    _esp8266_ota_stage_record_clear();
+    _esp8266_ota_new_fw_version_maj = version_maj;
+    _esp8266_ota_new_fw_version_min = version_min;
+
+    bootconf = rboot_get_config();
+    _esp8266_ota_push->write_status = rboot_write_init(bootconf.roms[_esp8266_ota_push->rom_slot]);
+    MD5Init(&_esp8266_ota_push->md5);
+    _esp8266_ota_push->state = ESP8266_OTA_PUSH_STATE_DATA;
+
+    os_sprintf(message, "OTA READY %u\n", _esp8266_ota_push->rom_slot);
+    _esp8266_ota_push_reply(message, false);
+    return true;
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_write(uint8_t* data, uint32_t length)
+{
+    //BURN A CHUNK OF PUSHED IMAGE TO FLASH, REPORT PROGRESS
+    //AND VERIFY THE DIGEST ONCE THE LAST BYTE IS IN
+
+    uint8_t digest[16];
+    uint8_t progress;
+    char message[ESP8266_OTA_PUSH_REPLY_MAX_LEN];
+
+    if(_esp8266_ota_push->total_len + length > _esp8266_ota_push->content_len)
+    {
+        _esp8266_ota_push_fail("LENGTH");
+        return;
+    }
+    if(!rboot_write_flash(&_esp8266_ota_push->write_status, data, length))
+    {
+        _esp8266_ota_push_fail("WRITE");
+        return;
+    }
+    MD5Update(&_esp8266_ota_push->md5, data, length);
+    _esp8266_ota_push->total_len += length;
+
+    if(_esp8266_ota_push->total_len < _esp8266_ota_push->content_len)
+    {
+        //PROGRESS IS BEST EFFORT, SKIP IF A REPLY IS STILL GOING OUT
+        progress = (_esp8266_ota_push->total_len * 100) / _esp8266_ota_push->content_len;
+        if(progress >= _esp8266_ota_push->last_progress + ESP8266_OTA_PUSH_PROGRESS_STEP &&
+            !_esp8266_ota_push->sending)
+        {
+            _esp8266_ota_push->last_progress = progress;
+            os_sprintf(message, "OTA PROGRESS %u\n", progress);
+            _esp8266_ota_push_reply(message, false);
+        }
+        return;
+    }
+
+    //ALL BYTES IN, CHECK DIGEST
+    MD5Final(digest, &_esp8266_ota_push->md5);
+    if(os_memcmp(digest, _esp8266_ota_push->digest, 16) != 0)
+    {
+        _esp8266_ota_push_fail("DIGEST");
+        return;
+    }
+
+    //COMPLETION (REBOOT OR STAGE) RUNS FROM THE DISCONNECT CB
+    //SO THE HOST SEES OTA OK FIRST
+    system_upgrade_flag_set(ESP8266_OTA_UPGRADE_FLAG_FINISH);
+    _esp8266_ota_push->result = true;
+    os_printf("ESP8266 : OTA : Push image received and verified\n");
+    _esp8266_ota_push_reply("OTA OK\n", true);
+}
+
+static void ICACHE_FLASH_ATTR _esp8266_ota_push_hmac_md5(const char* key, const char* message, uint8_t* mac)
+{
+    //HMAC-MD5 (RFC 2104) OF message WITH key, 16 BYTE RESULT IN mac
+    //MUST MATCH THE AUTH TEST VECTOR IN ESP8266_OTA.h (tools/test_esp8266_ota_push.py)
+
+    ESP8266_OTA_MD5_CTX ctx;
+    uint8_t key_block[64];
+    uint8_t inner[16];
+    uint32_t key_len = os_strlen(key);
+    uint8_t i;
+
+    //KEYS LONGER THAN A BLOCK ARE HASHED FIRST
+    os_memset(key_block, 0, sizeof(key_block));
+    if(key_len > sizeof(key_block))
+    {
+        MD5Init(&ctx);
+        MD5Update(&ctx, (const uint8*)key, key_len);
+        MD5Final(key_block, &ctx);
+    }
+    else
+    {
+        os_memcpy(key_block, key, key_len);
+    }
+
+    //INNER : md5((key ^ ipad) + message)
+    for(i = 0; i < sizeof(key_block); i++)
+        key_block[i] ^= 0x36;
+    MD5Init(&ctx);
+    MD5Update(&ctx, key_block, sizeof(key_block));
+    MD5Update(&ctx, (const uint8*)message, os_strlen(message));
+    MD5Final(inner, &ctx);
+
+    //OUTER : md5((key ^ opad) + inner)
+    for(i = 0; i < sizeof(key_block); i++)
+        key_block[i] ^= (0x36 ^ 0x5C);
+    MD5Init(&ctx);
+    MD5Update(&ctx, key_block, sizeof(key_block));
+    MD5Update(&ctx, inner, sizeof(inner));
+    MD5Final(mac, &ctx);
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_digest_equal(const uint8_t* a, const uint8_t* b)
+{
+    //CONSTANT TIME COMPARE OF TWO 16 BYTE DIGESTS
+
+    uint8_t diff = 0;
+    uint8_t i;
+
+    for(i = 0; i < 16; i++)
+    {
+        diff |= a[i] ^ b[i];
+    }
+    return (diff == 0);
+}
+
+static bool ICACHE_FLASH_ATTR _esp8266_ota_push_hex_to_bytes(char* hex, uint8_t* bytes, uint8_t count)
+{
+    //HEX STRING OF EXACTLY count BYTES TO BINARY
+
+    uint8_t i, nibble;
+    char c;
+
+    if(os_strlen(hex) != (count * 2))
+    {
+        return false;
+    }
+    for(i = 0; i < (count * 2); i++)
+    {
+        c = hex[i];
+        if(c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            nibble = c - 'A' + 10;
+        else
+            return false;
+
+        if(i % 2 == 0)
+            bytes[i / 2] = nibble << 4;
+        else
+            bytes[i / 2] |= nibble;
+    }
+    return true;
+}
+
+static char* ICACHE_FLASH_ATTR _esp8266_ota_push_next_token(char** cursor)
+{
+    //RETURN NEXT SPACE SEPARATED TOKEN (IN PLACE, DESTRUCTIVE), NULL IF NONE
+
+    char* start = *cursor;
+    char* end;
+
+    while(*start == ' ' || *start == '\r')
+        start++;
+    if(*start == '\0')
+        return NULL;
+
+    end = start;
+    while(*end != '\0' && *end != ' ' && *end != '\r')
+        end++;
+    if(*end != '\0')
+        *end++ = '\0';
+    *cursor = end;
+    return start;
+}
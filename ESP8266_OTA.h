@@ -65,6 +65,71 @@
 // USED TO INDICATE NON ROM FLASH
 #define ESP8266_OTA_FLASH_BY_ADDR       0xFF
 
+//FLASH LAYOUT AT THE END OF FLASH (ANY SPI_SIZE_MAP)
+//  LAST 4 SECTORS : SDK SYSTEM PARAMS
+//  1 SECTOR BELOW : RF CAL (user_rf_cal_sector_set CONVENTION)
+#define ESP8266_OTA_FLASH_SECTOR_SIZE       0x1000
+#define ESP8266_OTA_SYSTEM_SECTORS          5
+
+//STAGED IMAGE RECORD (DOWNLOAD NOW, ACTIVATE LATER)
+//SAVED WITH system_param_save_with_protect() WHICH USES 3 CONSECUTIVE SECTORS
+//PLACED JUST BELOW THE RF CAL SECTOR, WORKED OUT FROM system_get_flash_size_map()
+//(E.G. SECTOR 0x3F8 ON 4MB, 0xF8 ON 1MB). DEFINE ESP8266_OTA_STAGE_RECORD_SECTOR
+//TO PLACE IT ELSEWHERE
+#define ESP8266_OTA_STAGE_RECORD_SECTORS    3
+#define ESP8266_OTA_STAGE_RECORD_MAGIC      0x5347544F
+
+//SCHEDULED ACTIVATION
+//  ESP8266_OTA_ScheduleActivationAt() : ABSOLUTE UNIX TIME FROM SNTP
+//      USE THIS FOR FLEET WIDE MAINTENANCE WINDOWS. THE APPLICATION MUST RUN
+//      SNTP (sntp_init). CHECKED EVERY ESP8266_OTA_STAGE_SCHEDULE_AT_TICK_MS,
+//      NOTHING HAPPENS UNTIL SNTP HAS SYNCED. SURVIVES REBOOTS EXACTLY
+//  ESP8266_OTA_ScheduleActivation() : RELATIVE, BEST EFFORT, PER DEVICE
+//      COUNTS DOWN MINUTES FROM WHEN THE DEVICE GOT THE CALL (os_timer CANNOT
+//      BE ARMED FOR DAYS IN ONE SHOT). MINUTES LEFT ARE WRITTEN BACK EVERY
+//      ESP8266_OTA_STAGE_SCHEDULE_SAVE_MINUTES SO IT SURVIVES A REBOOT, BUT
+//      POWERED OFF TIME IS NOT COUNTED AND UP TO SAVE_MINUTES OF PROGRESS CAN
+//      BE LOST. DEVICES SCHEDULED TOGETHER DRIFT APART, DO NOT USE IT FOR A
+//      FLEET WINDOW (USE ScheduleActivationAt OR CALL ESP8266_OTA_ActivateStaged
+//      FROM THE APPLICATION'S OWN CLOCK)
+#define ESP8266_OTA_STAGE_SCHEDULE_TICK_MS      60000
+#define ESP8266_OTA_STAGE_SCHEDULE_SAVE_MINUTES 60
+#define ESP8266_OTA_STAGE_SCHEDULE_AT_TICK_MS   1000
+
+//rom IMAGE FORMAT AS CHECKED BY rBoot (check_image)
+#define ESP8266_OTA_ROM_MAGIC               0xE9
+#define ESP8266_OTA_ROM_MAGIC_NEW           0xEA
+#define ESP8266_OTA_ROM_MAGIC_NEW2          0x04
+#define ESP8266_OTA_ROM_CHKSUM_INIT         0xEF
+//FLASH READ CHUNK WHEN VERIFYING A STAGED IMAGE
+#define ESP8266_OTA_VERIFY_BUFFER_SIZE      256
+
+//PUSH MODE (HOST STREAMS FIRMWARE TO A LISTENER ON THE DEVICE)
+//HOST CLIENT : tools/esp8266_ota_push.py
+//
+//PROTOCOL (ASCII LINES TERMINATED BY \n, THEN RAW IMAGE BYTES)
+//  DEVICE -> HOST : OTA NONCE <8 hex nonce> <target rom slot>
+//  HOST -> DEVICE : OTA <auth> <length> <major> <minor> <md5>
+//                   <length bytes of rom image for target slot>
+//                   auth = hex HMAC-MD5, KEY = password,
+//                          MESSAGE = "<nonce> <length> <major> <minor> <md5>"
+//                          (FIELDS EXACTLY AS SENT, SINGLE SPACES)
+//                   md5  = hex md5 of the image
+//                   TEST VECTOR : password "fleet-secret",
+//                     MESSAGE "1a2b3c4d 20000 1 2 0123456789abcdef0123456789abcdef"
+//                     -> auth 6946949dcacdc9f3d706078e27cd8458
+//  DEVICE -> HOST : OTA READY <rom slot>
+//                   OTA PROGRESS <percent>   (BEST EFFORT)
+//                   OTA OK | OTA ERR <reason>
+#define ESP8266_OTA_PUSH_DEFAULT_PORT       8266
+#define ESP8266_OTA_PUSH_HEADER_MAX_LEN     128
+#define ESP8266_OTA_PUSH_REPLY_MAX_LEN      32
+//INACTIVITY TIMEOUT FOR A PUSH CONNECTION (SECONDS)
+#define ESP8266_OTA_PUSH_TIMEOUT_S          (ESP8266_OTA_NETWORK_TIMEOUT_MS / 1000)
+#define ESP8266_OTA_PUSH_PROGRESS_STEP      10
+//DELAY BEFORE CLOSING A PUSH CONNECTION (NOT SAFE FROM INSIDE espconn CB)
+#define ESP8266_OTA_PUSH_CLOSE_DELAY_MS     10
+
 //CUSTOM VARIABLE STRUCTURES/////////////////////////////
 //END CUSTOM VARIABLE STRUCTURES/////////////////////////
 //USER CB FUNTION FORMAT TYPEDEF
@@ -76,6 +141,81 @@ typedef enum
     ESP8266_OTA_SERVER_OPERATION_GET_FILE_FW
 } ESP8266_OTA_OPERATION;
 
+typedef enum
+{
+    ESP8266_OTA_ACTIVATION_IMMEDIATE=0,
+    ESP8266_OTA_ACTIVATION_STAGED
+} ESP8266_OTA_ACTIVATION_MODE;
+
+typedef struct {
+	uint8 magic;
+	uint8 count;        // section count (second magic for new header)
+	uint8 flags1;
+	uint8 flags2;
+	uint32 entry;
+} ESP8266_OTA_ROM_HEADER;
+
+typedef struct {
+	uint8 magic;
+	uint8 count;
+	uint8 flags1;
+	uint8 flags2;
+	uint32 entry;
+	uint32 add;         // new type rom, irom0 section header
+	uint32 len;         // length of irom0 section
+} ESP8266_OTA_ROM_HEADER_NEW;
+
+typedef struct {
+	uint32 address;
+	uint32 length;
+} ESP8266_OTA_SECTION_HEADER;
+
+typedef struct {
+	uint32 magic;       // ESP8266_OTA_STAGE_RECORD_MAGIC IF VALID
+	uint32 rom_addr;    // flash address of staged rom (must match rboot config)
+	uint32 activate_minutes;    // relative activation countdown, 0 if none
+	uint32 activate_at;         // absolute activation unix time (SNTP), 0 if none
+	uint8 rom_slot;     // rom slot holding the staged image
+	uint8 version_maj;
+	uint8 version_min;
+	uint8 reserved;
+} ESP8266_OTA_STAGE_RECORD;
+
+typedef enum
+{
+    ESP8266_OTA_PUSH_STATE_HEADER=0,
+    ESP8266_OTA_PUSH_STATE_DATA,
+    ESP8266_OTA_PUSH_STATE_CLOSING
+} ESP8266_OTA_PUSH_STATE;
+
+//CONTEXT FOR THE MD5 ROUTINES IN ESP8266 ROM
+typedef struct {
+	uint32 state[4];
+	uint32 count[2];
+	uint8 buffer[64];
+} ESP8266_OTA_MD5_CTX;
+
+typedef struct {
+	struct espconn *conn;   // connected host (owned by espconn)
+	uint8 remote_ip[4];     // identifies the host in listener callbacks
+	int remote_port;
+	ESP8266_OTA_PUSH_STATE state;
+	uint8 rom_slot;
+	bool upgrading;         // upgrade flag set by this push
+	bool result;
+	bool sending;
+	uint8 last_progress;
+	uint8 header_len;
+	char nonce[9];
+	char header[ESP8266_OTA_PUSH_HEADER_MAX_LEN];
+	char pending[ESP8266_OTA_PUSH_REPLY_MAX_LEN];
+	uint32 total_len;
+	uint32 content_len;
+	uint8 digest[16];
+	ESP8266_OTA_MD5_CTX md5;
+	rboot_write_status write_status;
+} ESP8266_OTA_PUSH_STATUS;
+
 typedef struct {
 	uint8 rom_slot;   // rom slot to update, or FLASH_BY_ADDR
 	ESP8266_OTA_CALLBACK callback;  // user callback when completed
@@ -94,7 +234,16 @@ void ICACHE_FLASH_ATTR ESP8266_OTA_Initialize(char* server,
                                                 char* server_path,
                                                 char* name_rom0,
                                                 char* name_rom1);
+void ICACHE_FLASH_ATTR ESP8266_OTA_SetActivationMode(ESP8266_OTA_ACTIVATION_MODE mode);
+
 //CONTROL FUNCTIONS
 bool ICACHE_FLASH_ATTR ESP8266_OTA_Start();
+bool ICACHE_FLASH_ATTR ESP8266_OTA_IsImageStaged(void);
+bool ICACHE_FLASH_ATTR ESP8266_OTA_ActivateStaged(void);
+bool ICACHE_FLASH_ATTR ESP8266_OTA_ScheduleActivation(uint32_t delay_minutes);
+bool ICACHE_FLASH_ATTR ESP8266_OTA_ScheduleActivationAt(uint32_t timestamp);
+void ICACHE_FLASH_ATTR ESP8266_OTA_CancelScheduledActivation(void);
+bool ICACHE_FLASH_ATTR ESP8266_OTA_PushListen(uint16_t port, char* password);
+bool ICACHE_FLASH_ATTR ESP8266_OTA_PushStop(void);
 //END FUNCTION PROTOTYPES/////////////////////////////////
 #endif
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#################################################################
+# ESP8266 OTA UPDATE LIBRARY - PUSH MODE HOST CLIENT
+#
+# STREAMS A rom IMAGE TO A DEVICE RUNNING ESP8266_OTA_PushListen()
+# SEE THE PUSH PROTOCOL DESCRIPTION IN ESP8266_OTA.h
+#
+# USAGE:
+#   export ESP8266_OTA_PASS=<pass>
+#   esp8266_ota_push.py --host <ip>
+#                       --rom0 user1.4096.new.6.bin --rom1 user2.4096.new.6.bin
+#                       --major <x> --minor <y> [--port 8266]
+#
+# THE PASSWORD IS READ FROM THE ENVIRONMENT SO IT DOES NOT SHOW UP IN ps
+#
+# THE DEVICE REPORTS WHICH rom SLOT IS INACTIVE, THE MATCHING
+# IMAGE (--rom0 / --rom1) IS SENT
+#################################################################
+
+import argparse
+import hashlib
+import hmac
+import os
+import socket
+import sys
+
+DEFAULT_PORT = 8266
+PASSWORD_ENV = "ESP8266_OTA_PASS"
+CHUNK_SIZE = 1024
+TIMEOUT_S = 30
+
+
+def read_line(sock_file):
+    line = sock_file.readline()
+    if not line:
+        raise RuntimeError("connection closed by device")
+    return line.decode("ascii").strip()
+
+
+def device_error(sock_file):
+    # AFTER A FAILED SEND, LOOK FOR THE OTA ERR THE DEVICE SENT BEFORE CLOSING
+    try:
+        while True:
+            line = sock_file.readline()
+            if not line:
+                return None
+            line = line.decode("ascii").strip()
+            if line.startswith("OTA ERR"):
+                return line
+    except OSError:
+        return None
+
+
+def auth_token(password, nonce, length, major, minor, digest):
+    # HEX HMAC-MD5(password, "<nonce> <length> <major> <minor> <md5>")
+    # MUST MATCH _esp8266_ota_push_hmac_md5() IN ESP8266_OTA.c
+    msg = "%s %d %d %d %s" % (nonce, length, major, minor, digest)
+    return hmac.new(password.encode("utf-8"), msg.encode("ascii"),
+                    hashlib.md5).hexdigest()
+
+
+def push(host, port, password, roms, major, minor):
+    sock = socket.create_connection((host, port), timeout=TIMEOUT_S)
+    sock_file = sock.makefile("rb")
+    try:
+        # OTA NONCE <nonce> <rom slot>
+        fields = read_line(sock_file).split()
+        if len(fields) != 4 or fields[:2] != ["OTA", "NONCE"]:
+            raise RuntimeError("unexpected greeting: %s" % " ".join(fields))
+        nonce, rom_slot = fields[2], int(fields[3])
+        if rom_slot not in roms:
+            raise RuntimeError("device wants rom %d, no image given" % rom_slot)
+
+        with open(roms[rom_slot], "rb") as f:
+            image = f.read()
+
+        digest = hashlib.md5(image).hexdigest()
+        auth = auth_token(password, nonce, len(image), major, minor, digest)
+        header = "OTA %s %d %d %d %s\n" % (auth, len(image), major, minor, digest)
+        print("Pushing %s (%d bytes) to rom %d" % (roms[rom_slot], len(image), rom_slot))
+        sock.sendall(header.encode("ascii"))
+
+        reply = read_line(sock_file)
+        if not reply.startswith("OTA READY"):
+            raise RuntimeError(reply)
+
+        try:
+            for offset in range(0, len(image), CHUNK_SIZE):
+                sock.sendall(image[offset:offset + CHUNK_SIZE])
+        except OSError as e:
+            # DEVICE GAVE UP MID-STREAM (OTA ERR LENGTH / WRITE ...) AND CLOSED
+            raise RuntimeError(device_error(sock_file) or "send failed: %s" % e)
+
+        while True:
+            reply = read_line(sock_file)
+            if reply.startswith("OTA PROGRESS"):
+                print("  %s%%" % reply.split()[2])
+            elif reply == "OTA OK":
+                print("Done")
+                return True
+            else:
+                raise RuntimeError(reply)
+    finally:
+        sock_file.close()
+        sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Push firmware to an ESP8266_OTA device")
+    parser.add_argument("--host", required=True)
+    parser.add_argument("--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("--rom0", help="image for rom slot 0")
+    parser.add_argument("--rom1", help="image for rom slot 1")
+    parser.add_argument("--major", type=int, required=True)
+    parser.add_argument("--minor", type=int, required=True)
+    args = parser.parse_args()
+
+    roms = {}
+    if args.rom0:
+        roms[0] = args.rom0
+    if args.rom1:
+        roms[1] = args.rom1
+    if not roms:
+        parser.error("need --rom0 and/or --rom1")
+    password = os.environ.get(PASSWORD_ENV)
+    if not password:
+        parser.error("set the push password in $%s" % PASSWORD_ENV)
+
+    try:
+        push(args.host, args.port, password, roms, args.major, args.minor)
+    except (OSError, RuntimeError) as e:
+        print("Push failed: %s" % e, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
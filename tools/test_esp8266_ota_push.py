@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+#################################################################
+# ESP8266 OTA UPDATE LIBRARY - PUSH MODE SIMULATION TEST
+#
+# RUNS esp8266_ota_push.push() AGAINST A SIMULATED DEVICE THAT
+# SPEAKS THE DEVICE SIDE OF THE PUSH PROTOCOL IN ESP8266_OTA.h
+#
+# USAGE:
+#   python3 -m unittest discover -s tools
+#################################################################
+
+import hashlib
+import hmac
+import os
+import socket
+import sys
+import tempfile
+import threading
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import esp8266_ota_push  # noqa: E402
+
+PASSWORD = "fleet-secret"
+NONCE = "1a2b3c4d"
+PROGRESS_STEP = 10
+
+
+class FakeDevice(threading.Thread):
+    """DEVICE SIDE OF THE PUSH PROTOCOL, SERVES ONE CONNECTION
+
+    rom_slot : INACTIVE SLOT ANNOUNCED IN THE NONCE LINE
+    max_len  : SPACE IN THAT SLOT (LENGTH CHECK)
+    corrupt  : FLIP A RECEIVED BYTE, AS A FLASH/TRANSFER ERROR WOULD
+    greeting : SEND THIS LINE INSTEAD OF OTA NONCE
+    close_after : DROP THE CONNECTION AFTER THIS MANY IMAGE BYTES
+    err_after   : SEND OTA ERR WRITE AND CLOSE AFTER THIS MANY IMAGE BYTES
+    """
+
+    def __init__(self, rom_slot=1, max_len=0x100000, corrupt=False,
+                 greeting=None, close_after=None, err_after=None):
+        super().__init__(daemon=True)
+        self.rom_slot = rom_slot
+        self.max_len = max_len
+        self.corrupt = corrupt
+        self.greeting = greeting
+        self.close_after = close_after
+        self.err_after = err_after
+        self.image = None
+        self.result = None
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.listen(1)
+        self.port = self.sock.getsockname()[1]
+
+    def run(self):
+        conn, _ = self.sock.accept()
+        conn_file = conn.makefile("rb")
+        try:
+            self.result = self._serve(conn, conn_file)
+        except (OSError, ValueError):
+            self.result = "DROPPED"
+        finally:
+            conn_file.close()
+            conn.close()
+            self.sock.close()
+
+    def _serve(self, conn, conn_file):
+        if self.greeting is not None:
+            conn.sendall(self.greeting.encode("ascii") + b"\n")
+            return "GREETING"
+        conn.sendall(("OTA NONCE %s %d\n" % (NONCE, self.rom_slot)).encode("ascii"))
+
+        line = conn_file.readline()
+        if not line:
+            return "CLOSED"
+        fields = line.decode("ascii").split()
+        if len(fields) != 6 or fields[0] != "OTA":
+            return self._fail(conn, "HEADER")
+
+        auth, length, major, minor, digest = fields[1:]
+        expected = hmac.new(PASSWORD.encode("utf-8"),
+                            ("%s %s %s %s %s" % (NONCE, length, major, minor, digest)).encode("ascii"),
+                            hashlib.md5).hexdigest()
+        if not hmac.compare_digest(auth, expected):
+            return self._fail(conn, "AUTH")
+        length = int(length)
+        if length == 0 or length > self.max_len:
+            return self._fail(conn, "LENGTH")
+
+        conn.sendall(("OTA READY %d\n" % self.rom_slot).encode("ascii"))
+
+        received = bytearray()
+        last_progress = 0
+        while len(received) < length:
+            chunk = conn_file.read1(length - len(received))
+            if not chunk:
+                return "CLOSED"
+            received += chunk
+            if self.close_after is not None and len(received) >= self.close_after:
+                return "CLOSED"
+            if self.err_after is not None and len(received) >= self.err_after:
+                return self._fail(conn, "WRITE")
+            progress = len(received) * 100 // length
+            if len(received) < length and progress >= last_progress + PROGRESS_STEP:
+                last_progress = progress
+                conn.sendall(("OTA PROGRESS %d\n" % progress).encode("ascii"))
+
+        if self.corrupt:
+            received[len(received) // 2] ^= 0xFF
+        if hashlib.md5(received).hexdigest() != digest:
+            return self._fail(conn, "DIGEST")
+
+        self.image = bytes(received)
+        conn.sendall(b"OTA OK\n")
+        return "OK"
+
+    def _fail(self, conn, reason):
+        conn.sendall(("OTA ERR %s\n" % reason).encode("ascii"))
+        return reason
+
+
+class PushTest(unittest.TestCase):
+
+    def setUp(self):
+        self.image = os.urandom(20000)
+        fd, self.image_path = tempfile.mkstemp(suffix=".bin")
+        with os.fdopen(fd, "wb") as f:
+            f.write(self.image)
+
+    def tearDown(self):
+        os.remove(self.image_path)
+
+    def _write_image(self, size):
+        # SEPARATE IMAGE FILE, REMOVED WITH THE TEST
+        self.image = os.urandom(size)
+        with open(self.image_path, "wb") as f:
+            f.write(self.image)
+
+    def _push(self, device, password=PASSWORD, roms=None):
+        device.start()
+        if roms is None:
+            roms = {device.rom_slot: self.image_path}
+        try:
+            return esp8266_ota_push.push("127.0.0.1", device.port, password, roms, 1, 2)
+        finally:
+            device.join(5)
+
+    def test_auth_token_vector(self):
+        # SAME VECTOR AS THE PUSH PROTOCOL DESCRIPTION IN ESP8266_OTA.h
+        self.assertEqual(esp8266_ota_push.auth_token(PASSWORD, NONCE, 20000, 1, 2,
+                                                     "0123456789abcdef0123456789abcdef"),
+                         "6946949dcacdc9f3d706078e27cd8458")
+
+    def test_push_ok(self):
+        device = FakeDevice()
+        self.assertTrue(self._push(device))
+        self.assertEqual(device.result, "OK")
+        self.assertEqual(device.image, self.image)
+
+    def test_bad_auth_rejected(self):
+        device = FakeDevice()
+        with self.assertRaisesRegex(RuntimeError, "OTA ERR AUTH"):
+            self._push(device, password="wrong")
+        self.assertEqual(device.result, "AUTH")
+        self.assertIsNone(device.image)
+
+    def test_bad_digest_rejected(self):
+        device = FakeDevice(corrupt=True)
+        with self.assertRaisesRegex(RuntimeError, "OTA ERR DIGEST"):
+            self._push(device)
+        self.assertEqual(device.result, "DIGEST")
+        self.assertIsNone(device.image)
+
+    def test_oversize_rejected(self):
+        device = FakeDevice(max_len=len(self.image) - 1)
+        with self.assertRaisesRegex(RuntimeError, "OTA ERR LENGTH"):
+            self._push(device)
+        self.assertEqual(device.result, "LENGTH")
+        self.assertIsNone(device.image)
+
+    def test_unknown_rom_slot_rejected(self):
+        device = FakeDevice(rom_slot=1)
+        with self.assertRaisesRegex(RuntimeError, "device wants rom 1"):
+            self._push(device, roms={0: self.image_path})
+        self.assertIn(device.result, ("CLOSED", "DROPPED"))
+        self.assertIsNone(device.image)
+
+    def test_unexpected_greeting(self):
+        device = FakeDevice(greeting="HTTP/1.1 400 Bad Request")
+        with self.assertRaisesRegex(RuntimeError, "unexpected greeting"):
+            self._push(device)
+        self.assertEqual(device.result, "GREETING")
+
+    def test_device_closes_mid_stream(self):
+        device = FakeDevice(close_after=len(self.image) // 2)
+        with self.assertRaises((RuntimeError, OSError)):
+            self._push(device)
+        self.assertEqual(device.result, "CLOSED")
+        self.assertIsNone(device.image)
+
+    def test_err_while_sending(self):
+        # LARGE ENOUGH THAT THE DEVICE CLOSES BEFORE THE CLIENT FINISHES SENDING
+        self._write_image(8 * 1024 * 1024)
+        device = FakeDevice(max_len=len(self.image), err_after=50000)
+        with self.assertRaisesRegex(RuntimeError, "OTA ERR WRITE"):
+            self._push(device)
+        self.assertEqual(device.result, "WRITE")
+        self.assertIsNone(device.image)
+
+
+if __name__ == "__main__":
+    unittest.main()